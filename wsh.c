@@ -1,3 +1,4 @@
+#define _GNU_SOURCE           // Needed for sched_setaffinity() and the CPU_* macros
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,12 +6,49 @@
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
 
 #define MAX_ARGS 64           // Maximum number of arguments in a command
 #define DELIM " \t\r\n\a"     // Delimiters for splitting input
 
 #define DEFAULT_HISTORY_SIZE 5  // Default size for command history
 
+#define MAX_SETTING_LEN 64      // Maximum length of one field in a pipeline setting list
+
+#define CAPTURE_BUFSIZE 1024    // Initial size of a command substitution capture buffer
+#define SUBST_MARKER '\001'     // Surrounds the index of a substitution's output in a line
+
+#define SERVE_MAX_EVENTS 64         // Maximum epoll events handled per wakeup in serve mode
+#define SERVE_MAX_FRAME (1 << 20)   // Maximum size of one request frame in serve mode
+#define SERVE_MAX_FDS 3             // Descriptors a request may pass: stdin, stdout, stderr
+#define SERVE_MAX_PENDING_FDS 64    // Passed descriptors a client may have queued at once
+#define SERVE_ACCEPT_RETRY_MS 100   // Pause before accepting again after running out of descriptors
+#define SERVE_MAX_PENDING_OUT (1 << 16) // Unsent reply bytes after which a client's requests wait
+
+// Kinds of loop constructs
+#define LOOP_FOR 0      // for NAME in WORDS; do ...; done
+#define LOOP_WHILE 1    // while COMMAND; do ...; done
+#define LOOP_REPEAT 2   // repeat N; do ...; done
+
+// Kinds of commands in a loop body
+#define LOOP_CMD_TEMPLATE 0  // Simple command parsed once into an argv template
+#define LOOP_CMD_LINE 1      // Command with pipes or substitutions, run as a full line
+#define LOOP_CMD_LOOP 2      // Nested loop
+
+// Kinds of argv template slots
+#define SLOT_LITERAL 0   // Fixed word, stored in the argv once
+#define SLOT_LOOP_VAR 1  // The enclosing for loop's variable, patched each iteration
+#define SLOT_VARIABLE 2  // Any other $VAR, looked up each iteration
+
 // Structure to store command history
 typedef struct {
     char** commands;   // Array of command strings
@@ -29,6 +67,84 @@ typedef struct ShellVariable {
 
 ShellVariable *shell_variables = NULL; // Head of the list of shell variables
 
+// Structure for a growable character buffer
+typedef struct {
+    char *data;       // Buffer contents, always null-terminated
+    size_t len;       // Number of characters stored
+    size_t capacity;  // Allocated size of data
+} Buffer;
+
+// Structure for a cached command substitution result
+typedef struct MemoEntry {
+    char *key;               // Working directory and expanded argv, joined with spaces
+    unsigned long env_hash;  // Hash of the environment the command ran in
+    char *output;            // Captured output of the command
+    struct MemoEntry *next;  // Pointer to the next entry in the list
+} MemoEntry;
+
+// Structure for the command substitution memo cache
+typedef struct {
+    int enabled;        // Whether results are cached
+    MemoEntry *entries; // Head of the list of cached results
+    long hits;          // Number of substitutions answered from the cache
+    long misses;        // Number of substitutions that had to run
+} MemoCache;
+
+MemoCache memo_cache = {0, NULL, 0, 0}; // Global memo cache, off by default
+
+// Structure for the outputs of the command substitutions in the lines being run.
+// A line refers to an output by its index, so the output is never parsed as syntax.
+typedef struct {
+    char **outputs;  // Captured outputs, in the order the substitutions ran
+    int count;       // Number of outputs stored
+    int capacity;    // Allocated size of outputs
+} SubstitutionTable;
+
+SubstitutionTable substitutions = {NULL, 0, 0}; // Global substitution outputs
+
+// Structure for a client connected to the serve mode socket
+typedef struct ServeClient {
+    int fd;                       // Client socket, or -1 once the client has hung up
+    Buffer in;                    // Bytes received but not yet handled
+    Buffer out;                   // Reply bytes not yet sent
+    int read_closed;              // Whether the client has shut down its sending side
+    uint32_t events;              // Events registered with epoll, or 0 when not registered
+    int fds[SERVE_MAX_PENDING_FDS];          // Passed descriptors not yet given to a request
+    size_t fd_offsets[SERVE_MAX_PENDING_FDS]; // Offset in 'in' of the read each one arrived with
+    int num_fds;                             // Number of descriptors in fds
+    pid_t pid;                    // Child running the current request, or 0 when idle
+    struct timespec start;        // When the current request was started
+    struct ServeClient *next;     // Pointer to the next client in the list
+} ServeClient;
+
+ServeClient *serve_clients = NULL; // Head of the list of serve mode clients
+int serve_epoll_fd = -1;           // epoll instance used by serve mode
+
+struct Loop;
+
+// Structure for one command in a loop body
+typedef struct LoopCommand {
+    int kind;                  // One of the LOOP_CMD_* kinds
+    char *text;                // Command text; template words point into it
+    char **words;              // Template words as written, such as "$x"
+    char **argv;               // Reusable argv for a template, patched before each run
+    int *slots;                // Slot kind of each argv entry for a template
+    struct Loop *loop;         // Nested loop for LOOP_CMD_LOOP
+    struct LoopCommand *next;  // Pointer to the next command in the body
+} LoopCommand;
+
+// Structure for a parsed loop
+typedef struct Loop {
+    int type;                // One of the LOOP_* types
+    char *var;               // Loop variable name for a for loop
+    char *words;             // Unexpanded word list for a for loop
+    long count;              // Number of iterations for a repeat loop
+    LoopCommand *condition;  // Condition command for a while loop
+    LoopCommand *body;       // Head of the list of body commands
+} Loop;
+
+extern char **environ;
+
 // Function to display the shell prompt
 void display_prompt() {
     printf("wsh> ");
@@ -61,6 +177,83 @@ ShellVariable* find_shell_variable(char *name) {
     return NULL;
 }
 
+// Function to initialize an empty growable buffer
+void buffer_init(Buffer *buf) {
+    buf->capacity = CAPTURE_BUFSIZE;
+    buf->len = 0;
+    buf->data = malloc(buf->capacity);
+    if (!buf->data) {
+        fprintf(stderr, "wsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    buf->data[0] = '\0';
+}
+
+// Function to append characters to a growable buffer, doubling its size as needed
+void buffer_append(Buffer *buf, const char *data, size_t len) {
+    if (buf->len + len + 1 > buf->capacity) {
+        while (buf->len + len + 1 > buf->capacity) {
+            buf->capacity *= 2;
+        }
+        buf->data = realloc(buf->data, buf->capacity);
+        if (!buf->data) {
+            fprintf(stderr, "wsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+
+// Function to add a token to a token array, growing the array if necessary
+void append_token(char ***tokens, int *position, int *bufsize, char *token) {
+    (*tokens)[(*position)++] = token;
+    if (*position >= *bufsize) {
+        *bufsize += MAX_ARGS;
+        *tokens = realloc(*tokens, *bufsize * sizeof(char*));
+        if (!*tokens) {
+            fprintf(stderr, "wsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Function to add the words of a token containing command substitution markers.
+// Each marker is replaced by its captured output and the result is split into
+// words; the output is never checked for variables or other syntax.
+void append_substituted_words(char ***tokens, int *position, int *bufsize, char *token) {
+    Buffer text;
+    char *saveptr;
+
+    buffer_init(&text);
+    while (*token) {
+        char *marker = strchr(token, SUBST_MARKER);
+        if (marker == NULL) {
+            buffer_append(&text, token, strlen(token));
+            break;
+        }
+        buffer_append(&text, token, marker - token);
+
+        // Copy the output the marker refers to
+        char *end;
+        long index = strtol(marker + 1, &end, 10);
+        if (*end == SUBST_MARKER && index >= 0 && index < substitutions.count) {
+            buffer_append(&text, substitutions.outputs[index], strlen(substitutions.outputs[index]));
+            token = end + 1;
+        } else {
+            token = marker + 1;  // Not a marker we made; drop the stray character
+        }
+    }
+
+    char *word = strtok_r(text.data, DELIM, &saveptr);
+    while (word != NULL) {
+        append_token(tokens, position, bufsize, strdup(word));
+        word = strtok_r(NULL, DELIM, &saveptr);
+    }
+    free(text.data);
+}
 
 // Function to parse the input into an array of arguments
 char** parse_input(char* input) {
@@ -80,6 +273,13 @@ char** parse_input(char* input) {
     // Split the input into tokens based on the delimiter
     token = strtok(input, DELIM);
     while (token != NULL) {
+        // Check if the token holds command substitution output
+        if (strchr(token, SUBST_MARKER) != NULL) {
+            append_substituted_words(&tokens, &position, &bufsize, token);
+            token = strtok(NULL, DELIM);
+            continue;
+        }
+
         // Check if the token starts with a '$' indicating a variable
         if (token[0] == '$') {
             // Attempt to substitute the variable name with its value
@@ -98,24 +298,13 @@ char** parse_input(char* input) {
 
             // If the variable is found, use its value; otherwise, use an empty string
             if (value) {
-                tokens[position] = strdup(value);
+                append_token(&tokens, &position, &bufsize, strdup(value));
             } else {
-                tokens[position] = strdup("");
+                append_token(&tokens, &position, &bufsize, strdup(""));
             }
         } else {
             // If the token does not start with '$', use it as is
-            tokens[position] = strdup(token);
-        }
-        position++;
-
-        // Resize the token array if necessary
-        if (position >= bufsize) {
-            bufsize += MAX_ARGS;
-            tokens = realloc(tokens, bufsize * sizeof(char*));
-            if (!tokens) {
-                fprintf(stderr, "wsh: allocation error\n");
-                exit(EXIT_FAILURE);
-            }
+            append_token(&tokens, &position, &bufsize, strdup(token));
         }
 
         // Get the next token
@@ -127,8 +316,8 @@ char** parse_input(char* input) {
 }
 
 
-// Function to execute a command
-void execute_command(char **args) {
+// Function to execute a command and return its exit status
+int execute_command(char **args) {
     pid_t pid;  // Process ID for the child process
     pid_t wpid; // Process ID for the waiting process
     int status; // Status of the child process
@@ -140,13 +329,14 @@ void execute_command(char **args) {
         if (execvp(args[0], args) == -1) {
             // execvp failed, typically because the command was not found
             fprintf(stderr, "execvp: No such file or directory\n");
-            exit(1); // Exit with an error status
+            _exit(1); // Exit without flushing or rewinding the shell's stdio streams
         }
         // If execvp is successful, the child process does not return to this point
-        exit(1); // Exit with an error status, in case execvp fails unexpectedly
+        _exit(1); // Exit with an error status, in case execvp fails unexpectedly
     } else if (pid < 0) {
         // Forking failed, no child process was created
         perror("wsh"); // Print the error message
+        return 1;
     } else {
         // Parent process
         do {
@@ -158,6 +348,9 @@ void execute_command(char **args) {
 
     if (wpid > 0) { // Placeholder to avoid compiler warning, can be removed if not needed
     }
+
+    // Report a command killed by a signal as 128 plus the signal number, as other shells do
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
 }
 
 
@@ -233,11 +426,183 @@ int split_piped_commands(char* input, char** cmd1, char** cmd2) {
 }
 
 
-// Function to execute multiple piped commands
-void execute_multiple_pipe_commands(char **commands, int num_commands) {
+// Function to look up a variable, checking the environment before the shell variables
+char* lookup_variable(char *name) {
+    char *value = getenv(name);
+    if (!value) {
+        ShellVariable *var = find_shell_variable(name);
+        if (var) {
+            value = var->value;
+        }
+    }
+    return value;
+}
+
+// Function to copy the field for a pipeline stage out of a comma separated list.
+// Lists shorter than the pipeline wrap around, so "0,1" alternates between two values.
+int get_stage_field(const char *list, int stage, char *field) {
+    int num_fields = 1;
+    for (const char *p = list; *p; p++) {
+        if (*p == ',') {
+            num_fields++;
+        }
+    }
+
+    // Skip to the start of the field for this stage
+    const char *start = list;
+    for (int i = 0; i < stage % num_fields; i++) {
+        start = strchr(start, ',') + 1;
+    }
+
+    // Copy the field up to the next comma or the end of the list
+    size_t len = strcspn(start, ",");
+    if (len == 0 || len >= MAX_SETTING_LEN) {
+        return 0;
+    }
+    memcpy(field, start, len);
+    field[len] = '\0';
+    return 1;
+}
+
+// Function to find the CPU that 'auto' placement counts adjacent cores from
+int pipeline_base_cpu() {
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : cpu;
+}
+
+// Function to pin the calling pipeline stage to the CPUs requested in WSH_CPUS.
+// Each field is a CPU number or an inclusive range such as "2-3". The value 'auto'
+// places consecutive stages on adjacent allowed CPUs, starting at base_cpu.
+void apply_stage_affinity(int stage, int base_cpu) {
+    char *cpus = lookup_variable("WSH_CPUS");
+    char field[MAX_SETTING_LEN];
+    cpu_set_t set;
+
+    if (cpus == NULL || cpus[0] == '\0') {
+        return;
+    }
+
+    if (strcmp(cpus, "auto") == 0) {
+        cpu_set_t allowed;
+        int count = 0, start = 0;
+
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+            perror("wsh: sched_getaffinity");
+            return;
+        }
+
+        // Count the allowed CPUs and find where base_cpu sits among them
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                if (cpu < base_cpu) {
+                    start++;
+                }
+                count++;
+            }
+        }
+        if (count == 0) {
+            return;
+        }
+
+        // Walk the allowed CPUs to the one this stage should run on
+        int target = (start + stage) % count;
+        CPU_ZERO(&set);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+                CPU_SET(cpu, &set);
+                break;
+            }
+        }
+    } else {
+        if (!get_stage_field(cpus, stage, field)) {
+            fprintf(stderr, "wsh: invalid WSH_CPUS: %s\n", cpus);
+            return;
+        }
+
+        // Parse a single CPU or an inclusive range of CPUs
+        char *end;
+        long first = strtol(field, &end, 10);
+        long last = first;
+        if (*end == '-') {
+            last = strtol(end + 1, &end, 10);
+        }
+        if (end == field || *end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE) {
+            fprintf(stderr, "wsh: invalid CPU list: %s\n", field);
+            return;
+        }
+
+        CPU_ZERO(&set);
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, &set);
+        }
+    }
+
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        perror("wsh: sched_setaffinity");
+    }
+}
+
+// Function to apply the scheduling policy (WSH_SCHED) and nice value (WSH_NICE)
+// requested for the calling pipeline stage
+void apply_stage_scheduling(int stage) {
+    char *policies = lookup_variable("WSH_SCHED");
+    char *nices = lookup_variable("WSH_NICE");
+    char field[MAX_SETTING_LEN];
+
+    if (policies != NULL && policies[0] != '\0') {
+        struct sched_param param = {0};
+        int policy = -1;
+
+        if (get_stage_field(policies, stage, field)) {
+            if (strcmp(field, "other") == 0) {
+                policy = SCHED_OTHER;
+            } else if (strcmp(field, "batch") == 0) {
+                policy = SCHED_BATCH;
+            } else if (strcmp(field, "idle") == 0) {
+                policy = SCHED_IDLE;
+            } else if (strcmp(field, "fifo") == 0) {
+                policy = SCHED_FIFO;
+            } else if (strcmp(field, "rr") == 0) {
+                policy = SCHED_RR;
+            }
+        }
+
+        if (policy < 0) {
+            fprintf(stderr, "wsh: invalid WSH_SCHED: %s\n", policies);
+        } else {
+            // Real-time policies need a priority; use the lowest one
+            if (policy == SCHED_FIFO || policy == SCHED_RR) {
+                param.sched_priority = sched_get_priority_min(policy);
+            }
+            if (sched_setscheduler(0, policy, &param) != 0) {
+                perror("wsh: sched_setscheduler");
+            }
+        }
+    }
+
+    if (nices != NULL && nices[0] != '\0') {
+        char *end;
+
+        if (!get_stage_field(nices, stage, field)) {
+            fprintf(stderr, "wsh: invalid WSH_NICE: %s\n", nices);
+            return;
+        }
+        long nice_value = strtol(field, &end, 10);
+        if (*end != '\0') {
+            fprintf(stderr, "wsh: invalid nice value: %s\n", field);
+        } else if (setpriority(PRIO_PROCESS, 0, (int) nice_value) != 0) {
+            perror("wsh: setpriority");
+        }
+    }
+}
+
+
+// Function to execute multiple piped commands and return the last command's exit status
+int execute_multiple_pipe_commands(char **commands, int num_commands) {
     int i, in_fd = 0;  // Initialize the input file descriptor for the first command
     int fd[2];  // File descriptors for the pipe
     pid_t pid;  // Process ID
+    int base_cpu = pipeline_base_cpu();  // First CPU used by 'auto' placement
 
     // Allocate an array to store child process IDs
     pid_t *child_pids = malloc(num_commands * sizeof(pid_t));
@@ -266,11 +631,14 @@ void execute_multiple_pipe_commands(char **commands, int num_commands) {
                 close(fd[1]);  // Close the write end of the pipe
                 close(fd[0]);  // Close the read end of the pipe
             }
+            // Place this stage on its CPUs and apply its scheduling settings
+            apply_stage_affinity(i, base_cpu);
+            apply_stage_scheduling(i);
             char **cmd_args = parse_input(commands[i]);  // Parse the command
             execvp(cmd_args[0], cmd_args);  // Execute the command
             // If execvp returns, it must have failed
             fprintf(stderr, "wsh: command not found: %s\n", cmd_args[0]);
-            exit(1);
+            _exit(1);  // Exit without flushing or rewinding the shell's stdio streams
         } else if (pid < 0) {
             perror("fork");
             exit(1);
@@ -291,13 +659,32 @@ void execute_multiple_pipe_commands(char **commands, int num_commands) {
     }
 
     // Wait for all child processes to finish
+    int status = 0;
     for (i = 0; i < num_commands; i++) {
-        int status;
         waitpid(child_pids[i], &status, WUNTRACED);
     }
 
     // Free the allocated memory for child process IDs
     free(child_pids);
+
+    // The pipeline's status is that of its last command, as in other shells
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// Function to split a line at each pipe character and run it as a pipeline,
+// returning the last command's exit status
+int execute_pipeline(char *line) {
+    char *commands[MAX_ARGS];
+    int num_commands = 0;
+
+    // Tokenize the line by the pipe symbol to separate commands
+    char *command = strtok(line, "|");
+    while (command != NULL && num_commands < MAX_ARGS) {
+        commands[num_commands++] = command;
+        command = strtok(NULL, "|");
+    }
+
+    return execute_multiple_pipe_commands(commands, num_commands);
 }
 
 // Function prototypes for built-in shell commands
@@ -307,6 +694,7 @@ int wsh_export(char **args);  // Export a variable to the environment
 int wsh_local(char **args);   // Set a local shell variable
 int wsh_vars(char **args);    // List all shell variables
 int handle_history_command(char **args); // Handle the history command
+int wsh_memo(char **args);    // Control the command substitution memo cache
 
 // Array of strings containing the names of the built-in commands
 char *builtin_str[] = {
@@ -315,7 +703,8 @@ char *builtin_str[] = {
     "export",
     "local",
     "vars",
-    "history"
+    "history",
+    "memo"
 };
 
 // Array of function pointers corresponding to the built-in commands
@@ -325,7 +714,8 @@ int (*builtin_func[]) (char **) = {
     &wsh_export,
     &wsh_local,
     &wsh_vars,
-    &handle_history_command
+    &handle_history_command,
+    &wsh_memo
 };
 
 
@@ -336,7 +726,22 @@ int wsh_num_builtins() {
     return sizeof(builtin_str) / sizeof(char *);
 }
 
-// Function to execute a built-in command
+// Function to find a built-in command by name, returning its index or -1
+int find_builtin(const char *name) {
+    // Iterate through the list of built-in commands to find a match
+    for (int i = 0; i < wsh_num_builtins(); i++) {
+        // Compare the input command with each built-in command
+        if (strcmp(name, builtin_str[i]) == 0) {
+            return i;
+        }
+    }
+
+    // The input command is not a built-in command
+    return -1;
+}
+
+// Function to execute a built-in command. Returns 0 if the command is not a
+// built-in; otherwise the built-in's result, 1 on success or -1 on failure.
 int execute_builtin(char **args) {
     // Check if the command is empty (i.e., no input was provided)
     if (args[0] == NULL) {
@@ -344,13 +749,10 @@ int execute_builtin(char **args) {
         return 1;
     }
 
-    // Iterate through the list of built-in commands to find a match
-    for (int i = 0; i < wsh_num_builtins(); i++) {
-        // Compare the input command with each built-in command
-        if (strcmp(args[0], builtin_str[i]) == 0) {
-            // If a match is found, execute the corresponding built-in function
-            return (*builtin_func[i])(args);
-        }
+    // If a match is found, execute the corresponding built-in function
+    int i = find_builtin(args[0]);
+    if (i >= 0) {
+        return (*builtin_func[i])(args);
     }
 
     // The input command is not a built-in command
@@ -364,12 +766,13 @@ int wsh_cd(char **args) {
     if (args[1] == NULL) {
         // If not, print an error message
         fprintf(stderr, "wsh: expected argument to \"cd\"\n");
-    } else {
-        // If yes, attempt to change the directory
-        if (chdir(args[1]) != 0) {
-            // If the change directory operation fails, print an error message
-            perror("wsh");
-        }
+        return -1;
+    }
+    // If yes, attempt to change the directory
+    if (chdir(args[1]) != 0) {
+        // If the change directory operation fails, print an error message
+        perror("wsh");
+        return -1;
     }
     // Return 1 to indicate that the shell should continue running
     return 1;
@@ -387,7 +790,7 @@ int wsh_export(char **args) {
     if (args[1] == NULL) {
         // If not, print an error message
         fprintf(stderr, "wsh: expected argument to \"export\"\n");
-        return 1;
+        return -1;
     }
 
     // Split the argument into the variable name and value
@@ -403,10 +806,12 @@ int wsh_export(char **args) {
         if (setenv(name, value, 1) != 0) {
             // If the set environment variable operation fails, print an error message
             perror("wsh");
+            return -1;
         }
     } else {
         // If the argument format is incorrect, print an error message
         fprintf(stderr, "wsh: export syntax error\n");
+        return -1;
     }
     // Return 1 to indicate that the shell should continue running
     return 1;
@@ -473,7 +878,7 @@ int wsh_local(char **args) {
     // Check if the argument is provided
     if (args[1] == NULL) {
         fprintf(stderr, "wsh: expected argument to \"local\"\n");
-        return 1;
+        return -1;
     }
 
     // Duplicate the argument to safely use strtok
@@ -486,7 +891,7 @@ int wsh_local(char **args) {
     if (name == NULL) {
         fprintf(stderr, "wsh: invalid format for local variable assignment\n");
         free(arg); // Free the duplicated argument
-        return 1;
+        return -1;
     }
 
     // If value is NULL, unset the variable; otherwise, set the variable
@@ -625,6 +1030,1214 @@ int handle_history_command(char** args) {
 }
 
 
+// Function to run a command line inside a forked child, then exit. Used for command
+// substitutions and served requests. Uses _exit() so the child does not flush or
+// rewind stdio streams shared with the shell, such as the batch file being read.
+void run_command_line_in_child(char *command) {
+    // Pipelines run through the normal pipe path, with their output going to our stdout
+    if (strstr(command, "|")) {
+        int status = execute_pipeline(command);
+        fflush(stdout);
+        _exit(status);
+    }
+
+    char **args = parse_input(command);
+    int result = execute_builtin(args);
+    if (result != 0) {
+        fflush(stdout);
+        _exit(result < 0 ? 1 : 0);  // Nothing to run, or a built-in already ran in this process
+    }
+
+    // Replace this child with the command itself, so no extra process is needed
+    execvp(args[0], args);
+    fprintf(stderr, "wsh: command not found: %s\n", args[0]);
+    _exit(1);
+}
+
+// Function to run a command and capture its standard output into memory.
+// Returns a newly allocated string with trailing newlines removed.
+char* capture_command_output(char *command) {
+    int pipefd[2];
+    pid_t pid;
+    Buffer out;
+
+    buffer_init(&out);
+    if (pipe(pipefd) == -1) {
+        perror("wsh");
+        return out.data;
+    }
+
+    // Flush pending output so the child does not write it into the capture
+    fflush(stdout);
+
+    pid = fork();
+    if (pid == 0) {
+        // Child process: send standard output into the pipe
+        close(pipefd[0]);
+        dup2(pipefd[1], STDOUT_FILENO);
+        close(pipefd[1]);
+        run_command_line_in_child(command);
+    } else if (pid < 0) {
+        perror("wsh");
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return out.data;
+    }
+
+    // Parent process: read everything the child writes
+    close(pipefd[1]);
+    char chunk[CAPTURE_BUFSIZE];
+    ssize_t n;
+    while ((n = read(pipefd[0], chunk, sizeof(chunk))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("wsh: read");
+            break;
+        }
+        buffer_append(&out, chunk, n);
+    }
+    close(pipefd[0]);
+    waitpid(pid, NULL, 0);
+
+    // Remove trailing newlines, as other shells do
+    while (out.len > 0 && out.data[out.len - 1] == '\n') {
+        out.data[--out.len] = '\0';
+    }
+    return out.data;
+}
+
+// Function to build the memo cache key for a command from the working directory
+// and its expanded arguments, so a 'cd' does not reuse results from elsewhere
+char* memo_key(char *command) {
+    char *copy = strdup(command);
+    char **args = parse_input(copy);
+    char *cwd = getcwd(NULL, 0);
+    Buffer key;
+
+    buffer_init(&key);
+    if (cwd != NULL) {
+        buffer_append(&key, cwd, strlen(cwd));
+        free(cwd);
+    }
+    for (int i = 0; args[i] != NULL; i++) {
+        buffer_append(&key, " ", 1);
+        buffer_append(&key, args[i], strlen(args[i]));
+        free(args[i]);
+    }
+    free(args);
+    free(copy);
+    return key.data;
+}
+
+// Function to hash the current environment, so cached results are not reused
+// after a variable they might depend on has changed
+unsigned long environment_hash() {
+    unsigned long hash = 14695981039346656037UL;  // FNV-1a offset basis
+    for (char **env = environ; *env != NULL; env++) {
+        for (const char *c = *env; *c; c++) {
+            hash = (hash ^ (unsigned char) *c) * 1099511628211UL;
+        }
+        hash = (hash ^ '\n') * 1099511628211UL;
+    }
+    return hash;
+}
+
+// Function to get the output of a command substitution, using the memo cache when it is on
+char* substitute_command(char *command) {
+    if (!memo_cache.enabled) {
+        return capture_command_output(command);
+    }
+
+    char *key = memo_key(command);
+    unsigned long env_hash = environment_hash();
+
+    // Look for a cached result for the same directory, arguments and environment
+    for (MemoEntry *entry = memo_cache.entries; entry != NULL; entry = entry->next) {
+        if (entry->env_hash == env_hash && strcmp(entry->key, key) == 0) {
+            memo_cache.hits++;
+            free(key);
+            return strdup(entry->output);
+        }
+    }
+
+    // Not cached: run the command and remember its output
+    memo_cache.misses++;
+    MemoEntry *entry = malloc(sizeof(MemoEntry));
+    entry->key = key;
+    entry->env_hash = env_hash;
+    entry->output = capture_command_output(command);
+    entry->next = memo_cache.entries;
+    memo_cache.entries = entry;
+    return strdup(entry->output);
+}
+
+// Function to store a command substitution's output and return its index
+int add_substitution(char *output) {
+    if (substitutions.count >= substitutions.capacity) {
+        substitutions.capacity += MAX_ARGS;
+        substitutions.outputs = realloc(substitutions.outputs, substitutions.capacity * sizeof(char*));
+        if (!substitutions.outputs) {
+            fprintf(stderr, "wsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    substitutions.outputs[substitutions.count] = output;
+    return substitutions.count++;
+}
+
+// Function to free the substitution outputs stored after the given count
+void release_substitutions(int count) {
+    while (substitutions.count > count) {
+        free(substitutions.outputs[--substitutions.count]);
+    }
+}
+
+// Function to run every $(...) command substitution in a line. Each one is replaced
+// by a marker holding the index of its output, which parse_input later splits into
+// words, so pipes or '$' in the output are never treated as syntax. Returns a newly
+// allocated line, or NULL if a substitution is not terminated. Callers release the
+// outputs with release_substitutions() once the line has run.
+char* expand_command_substitutions(const char *input) {
+    Buffer result;
+    const char *p = input;
+    const char *start;
+
+    buffer_init(&result);
+    while ((start = strstr(p, "$(")) != NULL) {
+        // Copy the text before the substitution as is
+        buffer_append(&result, p, start - p);
+
+        // Find the matching closing parenthesis, allowing nested parentheses
+        const char *end = start + 2;
+        int depth = 1;
+        while (*end) {
+            if (*end == '(') {
+                depth++;
+            } else if (*end == ')' && --depth == 0) {
+                break;
+            }
+            end++;
+        }
+        if (*end == '\0') {
+            fprintf(stderr, "wsh: unterminated command substitution\n");
+            free(result.data);
+            return NULL;
+        }
+
+        // Expand nested substitutions first, then run the command
+        char *inner = strndup(start + 2, end - (start + 2));
+        char *command = expand_command_substitutions(inner);
+        free(inner);
+        if (command == NULL) {
+            free(result.data);
+            return NULL;
+        }
+        char marker[32];
+        int index = add_substitution(substitute_command(command));
+        snprintf(marker, sizeof(marker), "%c%d%c", SUBST_MARKER, index, SUBST_MARKER);
+        buffer_append(&result, marker, strlen(marker));
+        free(command);
+
+        p = end + 1;
+    }
+    buffer_append(&result, p, strlen(p));
+    return result.data;
+}
+
+// Function to free every cached command substitution result
+void clear_memo_cache() {
+    MemoEntry *entry = memo_cache.entries;
+    while (entry != NULL) {
+        MemoEntry *next = entry->next;
+        free(entry->key);
+        free(entry->output);
+        free(entry);
+        entry = next;
+    }
+    memo_cache.entries = NULL;
+    memo_cache.hits = 0;
+    memo_cache.misses = 0;
+}
+
+// Function to handle the 'memo' built-in command
+int wsh_memo(char **args) {
+    // With no arguments, or 'stats', show the state of the cache
+    if (args[1] == NULL || strcmp(args[1], "stats") == 0) {
+        int entries = 0;
+        for (MemoEntry *entry = memo_cache.entries; entry != NULL; entry = entry->next) {
+            entries++;
+        }
+        printf("memo: %s, %d entries, %ld hits, %ld misses\n",
+               memo_cache.enabled ? "on" : "off", entries, memo_cache.hits, memo_cache.misses);
+    } else if (strcmp(args[1], "on") == 0) {
+        memo_cache.enabled = 1;
+    } else if (strcmp(args[1], "off") == 0) {
+        memo_cache.enabled = 0;
+        clear_memo_cache();
+    } else if (strcmp(args[1], "clear") == 0) {
+        clear_memo_cache();
+    } else {
+        fprintf(stderr, "wsh: usage: memo [on|off|clear|stats]\n");
+        return -1;
+    }
+    return 1;
+}
+
+
+// Function to close the descriptors a client passed but no request has used yet
+void serve_close_passed_fds(ServeClient *client) {
+    for (int i = 0; i < client->num_fds; i++) {
+        close(client->fds[i]);
+    }
+    client->num_fds = 0;
+}
+
+// Function to disconnect a client. Its record is kept until a running request exits.
+void serve_disconnect(ServeClient *client) {
+    if (client->events != 0) {
+        epoll_ctl(serve_epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+        client->events = 0;
+    }
+    close(client->fd);
+    client->fd = -1;
+    client->out.len = 0;
+    serve_close_passed_fds(client);
+}
+
+// Function to register the events a client needs: input until it shuts down its
+// sending side, and output only while replies are waiting. A client that needs
+// neither is left out of epoll, so a hung-up socket cannot wake the loop.
+void serve_update_events(ServeClient *client) {
+    struct epoll_event ev = {0};
+    uint32_t wanted = (client->read_closed ? 0 : EPOLLIN) | (client->out.len > 0 ? EPOLLOUT : 0);
+
+    if (client->fd < 0 || wanted == client->events) {
+        return;
+    }
+    ev.events = wanted;
+    ev.data.fd = client->fd;
+    if (wanted == 0) {
+        epoll_ctl(serve_epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    } else {
+        epoll_ctl(serve_epoll_fd, client->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, client->fd, &ev);
+    }
+    client->events = wanted;
+}
+
+// Function to send as much of a client's pending replies as the socket accepts
+void serve_flush(ServeClient *client) {
+    while (client->fd >= 0 && client->out.len > 0) {
+        ssize_t n = send(client->fd, client->out.data, client->out.len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("wsh: send");
+                serve_disconnect(client);
+            }
+            break;
+        }
+        memmove(client->out.data, client->out.data + n, client->out.len - n);
+        client->out.len -= n;
+    }
+    serve_update_events(client);
+}
+
+// Function to queue a framed reply to a serve mode client and start sending it.
+// Whatever the socket does not take now is sent when epoll reports it writable.
+void serve_send_reply(ServeClient *client, const char *reply) {
+    uint32_t len = strlen(reply) + 1;
+
+    if (client->fd < 0) {
+        return;
+    }
+    buffer_append(&client->out, (const char *) &len, sizeof(len));
+    buffer_append(&client->out, reply, len);
+    serve_flush(client);
+}
+
+// Function to start a request in a child process. The payload is a sequence of
+// null-terminated fields: "A<arg>" adds an argument, "E<NAME=VALUE>" overrides an
+// environment variable, and "L<line>" runs a full command line instead of an argv.
+// A request has either arguments or one line, never both. The descriptors passed
+// with the request become its stdin, stdout and stderr; the caller closes them.
+void serve_start_request(ServeClient *client, char *payload, uint32_t len, int *fds, int num_fds) {
+    char **argv_list = malloc((len / 2 + 2) * sizeof(char*));
+    char **env_list = malloc((len / 2 + 2) * sizeof(char*));
+    int num_args = 0, num_env = 0;
+    char *line = NULL;
+
+    if (!argv_list || !env_list) {
+        fprintf(stderr, "wsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Split the payload into its fields
+    if (len == 0 || payload[len - 1] != '\0') {
+        serve_send_reply(client, "error malformed request");
+        goto done;
+    }
+    for (char *field = payload; field < payload + len; field += strlen(field) + 1) {
+        if (field[0] == 'A') {
+            argv_list[num_args++] = field + 1;
+        } else if (field[0] == 'E' && strchr(field, '=') != NULL) {
+            env_list[num_env++] = field + 1;
+        } else if (field[0] == 'L' && line == NULL) {
+            line = field + 1;
+        } else if (field[0] == 'L') {
+            serve_send_reply(client, "error request has more than one line");
+            goto done;
+        } else {
+            serve_send_reply(client, "error unknown request field");
+            goto done;
+        }
+    }
+    argv_list[num_args] = NULL;
+    if (line == NULL && num_args == 0) {
+        serve_send_reply(client, "error empty request");
+        goto done;
+    }
+    if (line != NULL && num_args > 0) {
+        serve_send_reply(client, "error request has both a line and arguments");
+        goto done;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &client->start);
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child process: restore the signal mask the server blocked for its signalfd
+        sigset_t empty;
+        sigemptyset(&empty);
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+
+        // Apply the environment overrides
+        for (int i = 0; i < num_env; i++) {
+            char *name = strdup(env_list[i]);
+            char *value = strchr(name, '=');
+            *value++ = '\0';
+            setenv(name, value, 1);
+        }
+
+        // Passed descriptors become stdin, stdout and stderr, in that order.
+        // Without a passed stdin the request reads from /dev/null.
+        for (int i = 0; i < num_fds; i++) {
+            dup2(fds[i], i);
+        }
+        if (num_fds == 0) {
+            int devnull = open("/dev/null", O_RDONLY);
+            if (devnull >= 0) {
+                dup2(devnull, STDIN_FILENO);
+                close(devnull);
+            }
+        }
+
+        if (line != NULL) {
+            char *expanded = expand_command_substitutions(line);
+            if (expanded == NULL) {
+                _exit(1);
+            }
+            run_command_line_in_child(expanded);
+        }
+        execvp(argv_list[0], argv_list);
+        fprintf(stderr, "wsh: command not found: %s\n", argv_list[0]);
+        _exit(1);
+    } else if (pid < 0) {
+        perror("wsh: fork");
+        serve_send_reply(client, "error fork failed");
+    } else {
+        client->pid = pid;
+    }
+
+done:
+    free(argv_list);
+    free(env_list);
+}
+
+// Function to find how many more bytes complete the first unfinished frame in a
+// client's buffer, so reads never run past a frame boundary. Returns 0 when the
+// buffer ends with an oversized frame that will be rejected.
+size_t serve_bytes_to_frame_end(ServeClient *client) {
+    size_t pos = 0;
+    uint32_t len;
+
+    while (1) {
+        if (client->in.len - pos < sizeof(len)) {
+            return sizeof(len) - (client->in.len - pos);
+        }
+        memcpy(&len, client->in.data + pos, sizeof(len));
+        if (len > SERVE_MAX_FRAME) {
+            return 0;
+        }
+        if (client->in.len - pos < sizeof(len) + len) {
+            return pos + sizeof(len) + len - client->in.len;
+        }
+        pos += sizeof(len) + len;
+    }
+}
+
+// Function to start the next complete request a client has sent, if it is idle.
+// Each client runs one request at a time; different clients run concurrently.
+// A request gets only the descriptors that arrived with its first byte. Requests
+// wait while too many reply bytes are unsent. Once the client has shut down its
+// sending side and every request has run and been answered, it is disconnected.
+void serve_dispatch(ServeClient *client) {
+    uint32_t len;
+
+    while (client->pid == 0 && client->fd >= 0 && client->in.len >= sizeof(len) &&
+           client->out.len < SERVE_MAX_PENDING_OUT) {
+        memcpy(&len, client->in.data, sizeof(len));
+        if (len > SERVE_MAX_FRAME) {
+            // Stop reading; the connection closes once the error has been sent
+            serve_send_reply(client, "error request too large");
+            client->read_closed = 1;
+            client->in.len = 0;
+            serve_update_events(client);
+            break;
+        }
+        if (client->in.len < sizeof(len) + len) {
+            break;  // Wait for the rest of the frame
+        }
+        size_t used = sizeof(len) + len;
+
+        // Collect this frame's descriptors, and check none arrived part way through it
+        int fds[SERVE_MAX_FDS];
+        int num_fds = 0, too_many = 0, misplaced = 0;
+        for (int i = 0; i < client->num_fds; i++) {
+            if (client->fd_offsets[i] == 0) {
+                if (num_fds < SERVE_MAX_FDS) {
+                    fds[num_fds++] = client->fds[i];
+                } else {
+                    too_many = 1;
+                }
+            } else if (client->fd_offsets[i] < used) {
+                misplaced = 1;
+            }
+        }
+
+        if (misplaced) {
+            serve_send_reply(client, "error descriptors must arrive with the start of a request");
+        } else if (too_many) {
+            serve_send_reply(client, "error too many descriptors");
+        } else {
+            serve_start_request(client, client->in.data + sizeof(len), len, fds, num_fds);
+        }
+
+        // The child has its own copies, so close the frame's descriptors and
+        // move the rest down to match the buffer
+        int kept = 0;
+        for (int i = 0; i < client->num_fds; i++) {
+            if (client->fd_offsets[i] < used) {
+                close(client->fds[i]);
+            } else {
+                client->fds[kept] = client->fds[i];
+                client->fd_offsets[kept++] = client->fd_offsets[i] - used;
+            }
+        }
+        client->num_fds = kept;
+
+        // Drop the handled frame from the front of the buffer
+        memmove(client->in.data, client->in.data + used, client->in.len - used);
+        client->in.len -= used;
+    }
+
+    // Any bytes left after the client stopped sending can never form a frame
+    if (client->fd >= 0 && client->read_closed && client->pid == 0 && client->out.len == 0) {
+        serve_disconnect(client);
+    }
+}
+
+// Function to remove disconnected, idle clients from the list and free them
+void serve_free_clients() {
+    ServeClient **current = &serve_clients;
+    while (*current != NULL) {
+        ServeClient *client = *current;
+        if (client->fd < 0 && client->pid == 0) {
+            *current = client->next;
+            free(client->in.data);
+            free(client->out.data);
+            free(client);
+        } else {
+            current = &client->next;
+        }
+    }
+}
+
+// Function to read everything a client has sent, along with any passed descriptors.
+// Each read stops at the end of the current frame, so every descriptor batch can be
+// placed at the buffer offset where its read started.
+void serve_read_client(ServeClient *client) {
+    char data[CAPTURE_BUFSIZE];
+    char control[CMSG_SPACE(sizeof(int) * SERVE_MAX_PENDING_FDS)];
+
+    while (1) {
+        size_t want = serve_bytes_to_frame_end(client);
+        if (want == 0) {
+            break;  // Oversized frame; serve_dispatch rejects it
+        }
+        if (want > sizeof(data)) {
+            want = sizeof(data);
+        }
+        struct iovec iov = {data, want};
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t n = recvmsg(client->fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n == 0) {
+            // The client has finished sending; still run and answer what it sent
+            client->read_closed = 1;
+            serve_update_events(client);
+            break;
+        }
+        if (n < 0) {
+            perror("wsh: recvmsg");
+            serve_disconnect(client);
+            return;
+        }
+
+        // Queue passed descriptors with the offset of the bytes they arrived with
+        int overflow = (msg.msg_flags & MSG_CTRUNC) != 0;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                int *fds = (int *) CMSG_DATA(cmsg);
+                for (int i = 0; i < count; i++) {
+                    if (client->num_fds < SERVE_MAX_PENDING_FDS) {
+                        client->fds[client->num_fds] = fds[i];
+                        client->fd_offsets[client->num_fds++] = client->in.len;
+                    } else {
+                        close(fds[i]);
+                        overflow = 1;
+                    }
+                }
+            }
+        }
+        if (overflow) {
+            // Requests can no longer be matched with their descriptors
+            fprintf(stderr, "wsh: serve client passed too many descriptors\n");
+            serve_disconnect(client);
+            return;
+        }
+        buffer_append(&client->in, data, n);
+    }
+    serve_dispatch(client);
+}
+
+// Function to reap finished requests and send each client its exit status and timing
+void serve_reap_children() {
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (ServeClient *client = serve_clients; client != NULL; client = client->next) {
+            if (client->pid != pid) {
+                continue;
+            }
+
+            struct timespec end;
+            char reply[64];
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            long elapsed_us = (end.tv_sec - client->start.tv_sec) * 1000000L +
+                              (end.tv_nsec - client->start.tv_nsec) / 1000;
+            int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+            snprintf(reply, sizeof(reply), "exit %d time_us %ld", code, elapsed_us);
+            serve_send_reply(client, reply);
+            client->pid = 0;
+            serve_dispatch(client);
+            break;
+        }
+    }
+}
+
+// Function to serve command execution requests over a Unix domain socket. Requests
+// and replies are frames of a native-endian 32-bit length followed by the payload.
+void run_serve_mode(const char *path) {
+    struct sockaddr_un addr = {0};
+    struct epoll_event ev, events[SERVE_MAX_EVENTS];
+    struct stat st;
+    sigset_t mask;
+    int accept_paused = 0;  // Whether the listening socket is out of epoll after EMFILE
+    int accept_failing = 0; // Whether accepting has failed since the last success, to log once
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "wsh: socket path too long: %s\n", path);
+        exit(1);
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // Replace a stale socket left by an earlier server, but never any other file
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, SOMAXCONN) != 0) {
+        perror("wsh: serve");
+        exit(1);
+    }
+
+    // Receive child exits through a descriptor so epoll can wait on them
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    serve_epoll_fd = epfd;
+    if (signal_fd < 0 || epfd < 0) {
+        perror("wsh: serve");
+        exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+    ev.data.fd = signal_fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, signal_fd, &ev);
+
+    while (1) {
+        int n = epoll_wait(epfd, events, SERVE_MAX_EVENTS, accept_paused ? SERVE_ACCEPT_RETRY_MS : -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("wsh: epoll_wait");
+            exit(1);
+        }
+
+        // Start accepting again after a pause; requests may have freed descriptors
+        if (accept_paused) {
+            ev.events = EPOLLIN;
+            ev.data.fd = listen_fd;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+            accept_paused = 0;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == listen_fd) {
+                // Accept every pending connection
+                while (1) {
+                    int client_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (client_fd < 0) {
+                        if (errno == EINTR || errno == ECONNABORTED) {
+                            continue;
+                        }
+                        if (errno == EMFILE || errno == ENFILE) {
+                            // The connection stays pending, so stop watching the socket
+                            // for a while instead of spinning on it
+                            if (!accept_failing) {
+                                perror("wsh: accept");
+                                accept_failing = 1;
+                            }
+                            epoll_ctl(epfd, EPOLL_CTL_DEL, listen_fd, NULL);
+                            accept_paused = 1;
+                        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                            perror("wsh: accept");
+                        }
+                        break;
+                    }
+                    accept_failing = 0;
+
+                    ServeClient *client = calloc(1, sizeof(ServeClient));
+                    if (!client) {
+                        fprintf(stderr, "wsh: allocation error\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    client->fd = client_fd;
+                    buffer_init(&client->in);
+                    buffer_init(&client->out);
+                    client->next = serve_clients;
+                    serve_clients = client;
+                    serve_update_events(client);
+                }
+            } else if (fd == signal_fd) {
+                // Drain the pending signals, then reap every finished child
+                struct signalfd_siginfo info;
+                while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                }
+                serve_reap_children();
+            } else {
+                for (ServeClient *client = serve_clients; client != NULL; client = client->next) {
+                    if (client->fd != fd) {
+                        continue;
+                    }
+                    if (events[i].events & EPOLLERR) {
+                        serve_disconnect(client);
+                    } else {
+                        // A hang-up is read as end of input, after any data still queued
+                        if (events[i].events & (EPOLLIN | EPOLLHUP)) {
+                            serve_read_client(client);
+                        }
+                        if (client->out.len > 0) {
+                            serve_flush(client);
+                        }
+                        serve_dispatch(client);
+                    }
+                    break;
+                }
+            }
+        }
+        serve_free_clients();
+    }
+}
+
+
+// Function to execute one command line, with substitutions, pipes and built-ins,
+// and return its exit status. With record_history set, a line that runs a single
+// external command is added to the history as it was typed.
+int execute_line(char *line, int record_history) {
+    int first_output = substitutions.count;  // Outputs from here on belong to this line
+    char *expanded = expand_command_substitutions(line);
+    int status = 0;
+
+    if (expanded == NULL) {
+        release_substitutions(first_output);
+        return 1;
+    }
+
+    if (strstr(expanded, "|")) {
+        status = execute_pipeline(expanded);
+    } else {
+        char **args = parse_input(expanded);
+        int result = execute_builtin(args);
+        if (result == 0) {
+            // Not a built-in, so run it as an external command
+            status = execute_command(args);
+            if (record_history) {
+                add_to_history(line);
+            }
+        } else if (result < 0) {
+            status = 1;  // The built-in failed
+        }
+        for (int i = 0; args[i] != NULL; i++) {
+            free(args[i]);
+        }
+        free(args);
+    }
+
+    free(expanded);
+    release_substitutions(first_output);
+    return status;
+}
+
+// Function to check whether a string starts with the given word, ended by
+// whitespace, ';' or the end of the string
+int starts_with_word(const char *text, const char *word) {
+    size_t len = strlen(word);
+    return strncmp(text, word, len) == 0 &&
+           (text[len] == '\0' || text[len] == ';' || strchr(DELIM, text[len]) != NULL);
+}
+
+// Function to check whether a command starts a loop
+int is_loop_start(const char *text) {
+    text += strspn(text, DELIM);
+    return starts_with_word(text, "for") || starts_with_word(text, "while") ||
+           starts_with_word(text, "repeat");
+}
+
+// Function to split loop text in place into trimmed, non-empty segments at ';' and
+// newlines. A leading "do" is split into its own segment, so "do echo hi" becomes
+// "do" and "echo hi". Returns the number of segments stored in segs.
+int split_loop_segments(char *text, char ***segs) {
+    int capacity = MAX_ARGS;
+    int count = 0;
+
+    *segs = malloc(capacity * sizeof(char*));
+    if (!*segs) {
+        fprintf(stderr, "wsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char *seg = strtok(text, ";\n");
+    while (seg != NULL) {
+        // Trim whitespace from both ends
+        seg += strspn(seg, DELIM);
+        char *end = seg + strlen(seg);
+        while (end > seg && strchr(DELIM, end[-1]) != NULL) {
+            *--end = '\0';
+        }
+
+        if (*seg != '\0') {
+            // Leave room for a split "do" segment
+            if (count + 2 >= capacity) {
+                capacity += MAX_ARGS;
+                *segs = realloc(*segs, capacity * sizeof(char*));
+                if (!*segs) {
+                    fprintf(stderr, "wsh: allocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+
+            if (starts_with_word(seg, "do") && seg[2] != '\0') {
+                seg[2] = '\0';
+                (*segs)[count++] = seg;
+                seg += 3 + strspn(seg + 3, DELIM);
+            }
+            (*segs)[count++] = seg;
+        }
+        seg = strtok(NULL, ";\n");
+    }
+    return count;
+}
+
+// Function to read the remaining lines of a loop that spans several lines, until
+// every loop is closed by its "done". Returns the whole loop as one new string.
+char* collect_loop_text(const char *first_line, FILE *in, int interactive) {
+    Buffer text;
+    char *line = NULL;
+    size_t len = 0;
+
+    buffer_init(&text);
+    buffer_append(&text, first_line, strlen(first_line));
+
+    while (1) {
+        // Count how many loops are still open
+        char *copy = strdup(text.data);
+        char **segs;
+        int depth = 0;
+        int num_segs = split_loop_segments(copy, &segs);
+        for (int i = 0; i < num_segs; i++) {
+            if (is_loop_start(segs[i])) {
+                depth++;
+            } else if (strcmp(segs[i], "done") == 0) {
+                depth--;
+            }
+        }
+        free(segs);
+        free(copy);
+        if (depth <= 0) {
+            break;
+        }
+
+        // Read the next line of the loop
+        if (interactive) {
+            printf("> ");
+            fflush(stdout);
+        }
+        if (getline(&line, &len, in) == -1) {
+            fprintf(stderr, "wsh: unexpected end of file in loop\n");
+            free(line);
+            free(text.data);
+            return NULL;
+        }
+        buffer_append(&text, "\n", 1);
+        buffer_append(&text, line, strlen(line));
+    }
+
+    free(line);
+    return text.data;
+}
+
+// Function to parse a loop body command once. Simple commands become an argv
+// template whose variable slots are filled in on each run; anything needing the
+// full line parser is kept as text.
+LoopCommand* parse_loop_command(char *text, const char *loop_var) {
+    LoopCommand *cmd = calloc(1, sizeof(LoopCommand));
+    if (!cmd) {
+        fprintf(stderr, "wsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    cmd->text = strdup(text);
+
+    if (strstr(text, "|") || strstr(text, "$(")) {
+        cmd->kind = LOOP_CMD_LINE;
+        return cmd;
+    }
+
+    cmd->kind = LOOP_CMD_TEMPLATE;
+    cmd->words = malloc((strlen(text) / 2 + 2) * sizeof(char*));
+    cmd->argv = malloc((strlen(text) / 2 + 2) * sizeof(char*));
+    cmd->slots = malloc((strlen(text) / 2 + 2) * sizeof(int));
+    if (!cmd->words || !cmd->argv || !cmd->slots) {
+        fprintf(stderr, "wsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int position = 0;
+    char *token = strtok(cmd->text, DELIM);
+    while (token != NULL) {
+        cmd->words[position] = token;
+        cmd->argv[position] = token;
+        if (token[0] != '$') {
+            cmd->slots[position] = SLOT_LITERAL;
+        } else if (loop_var != NULL && strcmp(token + 1, loop_var) == 0) {
+            cmd->slots[position] = SLOT_LOOP_VAR;
+        } else {
+            cmd->slots[position] = SLOT_VARIABLE;
+        }
+        position++;
+        token = strtok(NULL, DELIM);
+    }
+    cmd->words[position] = NULL;
+    cmd->argv[position] = NULL;
+    return cmd;
+}
+
+// Function to free a parsed loop and all of its commands
+void free_loop(Loop *loop);
+
+// Function to free a list of loop commands
+void free_loop_commands(LoopCommand *cmd) {
+    while (cmd != NULL) {
+        LoopCommand *next = cmd->next;
+        if (cmd->loop != NULL) {
+            free_loop(cmd->loop);
+        }
+        free(cmd->text);
+        free(cmd->words);
+        free(cmd->argv);
+        free(cmd->slots);
+        free(cmd);
+        cmd = next;
+    }
+}
+
+void free_loop(Loop *loop) {
+    free(loop->var);
+    free(loop->words);
+    free_loop_commands(loop->condition);
+    free_loop_commands(loop->body);
+    free(loop);
+}
+
+// Function to parse the loop starting at segs[*pos], advancing *pos past its "done".
+// Returns NULL after printing an error if the loop is malformed.
+Loop* parse_loop(char **segs, int num_segs, int *pos) {
+    Loop *loop = calloc(1, sizeof(Loop));
+    if (!loop) {
+        fprintf(stderr, "wsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Parse the loop header
+    char *header = segs[(*pos)++];
+    const char *body_var = NULL;  // Only a for loop's own body has loop variable slots
+    if (starts_with_word(header, "for")) {
+        char *rest = header + 3 + strspn(header + 3, DELIM);
+        size_t name_len = strcspn(rest, DELIM);
+        char *in = rest + name_len + strspn(rest + name_len, DELIM);
+
+        if (name_len == 0 || !starts_with_word(in, "in")) {
+            fprintf(stderr, "wsh: expected \"for NAME in WORDS\"\n");
+            free_loop(loop);
+            return NULL;
+        }
+        loop->type = LOOP_FOR;
+        loop->var = strndup(rest, name_len);
+        loop->words = strdup(in + 2);
+        body_var = loop->var;
+    } else if (starts_with_word(header, "while")) {
+        char *condition = header + 5 + strspn(header + 5, DELIM);
+        if (*condition == '\0') {
+            fprintf(stderr, "wsh: expected a command after \"while\"\n");
+            free_loop(loop);
+            return NULL;
+        }
+        loop->type = LOOP_WHILE;
+        loop->condition = parse_loop_command(condition, NULL);
+    } else {
+        char *end;
+        loop->type = LOOP_REPEAT;
+        loop->count = strtol(header + 6, &end, 10);
+        if (end == header + 6 || loop->count < 0 || end[strspn(end, DELIM)] != '\0') {
+            fprintf(stderr, "wsh: expected \"repeat N\"\n");
+            free_loop(loop);
+            return NULL;
+        }
+    }
+
+    if (*pos >= num_segs || strcmp(segs[*pos], "do") != 0) {
+        fprintf(stderr, "wsh: expected \"do\"\n");
+        free_loop(loop);
+        return NULL;
+    }
+    (*pos)++;
+
+    // Parse the body up to the matching "done"
+    LoopCommand **tail = &loop->body;
+    while (*pos < num_segs && strcmp(segs[*pos], "done") != 0) {
+        LoopCommand *cmd;
+        if (is_loop_start(segs[*pos])) {
+            Loop *nested = parse_loop(segs, num_segs, pos);
+            if (nested == NULL) {
+                free_loop(loop);
+                return NULL;
+            }
+            cmd = calloc(1, sizeof(LoopCommand));
+            if (!cmd) {
+                fprintf(stderr, "wsh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+            cmd->kind = LOOP_CMD_LOOP;
+            cmd->loop = nested;
+        } else {
+            cmd = parse_loop_command(segs[(*pos)++], body_var);
+        }
+        *tail = cmd;
+        tail = &cmd->next;
+    }
+
+    if (*pos >= num_segs) {
+        fprintf(stderr, "wsh: expected \"done\"\n");
+        free_loop(loop);
+        return NULL;
+    }
+    (*pos)++;
+    return loop;
+}
+
+int run_loop(Loop *loop);
+
+// Function to run one loop command, given the current value of the loop variable
+int run_loop_command(LoopCommand *cmd, char *value) {
+    if (cmd->kind == LOOP_CMD_LOOP) {
+        return run_loop(cmd->loop);
+    }
+
+    if (cmd->kind == LOOP_CMD_LINE) {
+        // The line parser modifies its input, so run a copy
+        char *line = strdup(cmd->text);
+        int status = execute_line(line, 0);
+        free(line);
+        return status;
+    }
+
+    // Patch the variable slots of the template; literal words are already in place
+    for (int i = 0; cmd->words[i] != NULL; i++) {
+        if (cmd->slots[i] == SLOT_LOOP_VAR) {
+            cmd->argv[i] = value;
+        } else if (cmd->slots[i] == SLOT_VARIABLE) {
+            char *found = lookup_variable(cmd->words[i] + 1);
+            cmd->argv[i] = found ? found : "";
+        }
+    }
+
+    if (find_builtin(cmd->argv[0]) < 0) {
+        return execute_command(cmd->argv);
+    }
+
+    // Built-ins may modify their arguments, so give them their own copies
+    int argc = 0;
+    while (cmd->argv[argc] != NULL) {
+        argc++;
+    }
+    char **args = malloc((argc + 1) * sizeof(char*));
+    if (!args) {
+        fprintf(stderr, "wsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < argc; i++) {
+        args[i] = strdup(cmd->argv[i]);
+    }
+    args[argc] = NULL;
+
+    int result = execute_builtin(args);
+    for (int i = 0; i < argc; i++) {
+        free(args[i]);
+    }
+    free(args);
+    return result < 0 ? 1 : 0;
+}
+
+// Function to run a parsed loop
+int run_loop(Loop *loop) {
+    int status = 0;
+
+    if (loop->type == LOOP_FOR) {
+        // Expand the word list when the loop starts
+        int first_output = substitutions.count;
+        char *words = expand_command_substitutions(loop->words);
+        if (words == NULL) {
+            release_substitutions(first_output);
+            return 1;
+        }
+        char **items = parse_input(words);
+        release_substitutions(first_output);
+
+        // Environment variables are looked up before shell variables, so a loop
+        // over an environment name overrides it for the loop and restores it after
+        char *saved_env = getenv(loop->var);
+        if (saved_env != NULL) {
+            saved_env = strdup(saved_env);
+        }
+
+        for (int i = 0; items[i] != NULL; i++) {
+            // Also set the variable in the shell, for pipelines and nested commands
+            set_shell_variable(loop->var, items[i]);
+            if (saved_env != NULL) {
+                setenv(loop->var, items[i], 1);
+            }
+            for (LoopCommand *cmd = loop->body; cmd != NULL; cmd = cmd->next) {
+                status = run_loop_command(cmd, items[i]);
+            }
+        }
+
+        if (saved_env != NULL) {
+            setenv(loop->var, saved_env, 1);
+            free(saved_env);
+        }
+
+        for (int i = 0; items[i] != NULL; i++) {
+            free(items[i]);
+        }
+        free(items);
+        free(words);
+    } else if (loop->type == LOOP_WHILE) {
+        while (run_loop_command(loop->condition, NULL) == 0) {
+            for (LoopCommand *cmd = loop->body; cmd != NULL; cmd = cmd->next) {
+                status = run_loop_command(cmd, NULL);
+            }
+        }
+    } else {
+        for (long i = 0; i < loop->count; i++) {
+            for (LoopCommand *cmd = loop->body; cmd != NULL; cmd = cmd->next) {
+                status = run_loop_command(cmd, NULL);
+            }
+        }
+    }
+    return status;
+}
+
+// Function to parse and run text that starts with a loop. Commands after the
+// final "done" run as ordinary lines.
+void run_loop_text(char *text) {
+    char **segs;
+    int num_segs = split_loop_segments(text, &segs);
+    int pos = 0;
+
+    while (pos < num_segs) {
+        if (is_loop_start(segs[pos])) {
+            Loop *loop = parse_loop(segs, num_segs, &pos);
+            if (loop == NULL) {
+                break;
+            }
+            run_loop(loop);
+            free_loop(loop);
+        } else {
+            execute_line(segs[pos++], 0);
+        }
+    }
+    free(segs);
+}
+
+
 // Function to execute commands from a file in batch mode
 void run_batch_mode(const char *filename) {
     // Open the file for reading
@@ -639,7 +2252,6 @@ void run_batch_mode(const char *filename) {
     char *line = NULL;
     size_t len = 0;
     ssize_t read;
-    char *line2;
 
     // Read lines from the file until the end of the file is reached
     while ((read = getline(&line, &len, file)) != -1) {
@@ -648,19 +2260,18 @@ void run_batch_mode(const char *filename) {
             line[read - 1] = '\0';
         }
 
-        // Duplicate the line to avoid modifying the original buffer
-        line2 = strdup(line);
-
-        // Parse the input line into arguments
-        char **args = parse_input(line2);
-
-        // If the command is not a built-in command, execute it as an external command
-        if (!execute_builtin(args)) {
-            execute_command(args);
+        // Loops may span several lines; read the rest of the loop and run it
+        if (is_loop_start(line)) {
+            char *loop_text = collect_loop_text(line, file, 0);
+            if (loop_text != NULL) {
+                run_loop_text(loop_text);
+                free(loop_text);
+            }
+            continue;
         }
 
-        // Free the duplicated line after processing
-        free(line2);
+        // Execute the line the same way interactive mode does
+        execute_line(line, 0);
     }
 
     // Free the buffer used for reading lines and close the file
@@ -672,9 +2283,18 @@ void run_batch_mode(const char *filename) {
 int main(int argc, char *argv[]) {
     // Variable declarations
     char *input;
-    char **args;
     int status = 1;
 
+    // Check if the program was asked to serve requests over a Unix socket
+    if (argc > 1 && strcmp(argv[1], "--serve") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "wsh: usage: wsh --serve <socket path>\n");
+            return 1;
+        }
+        run_serve_mode(argv[2]); // Serve requests until the shell is killed
+        return 0;
+    }
+
     // Check if the program was run with a filename argument for batch mode
     if (argc > 1) {
         run_batch_mode(argv[1]); // Execute commands from the file
@@ -694,36 +2314,22 @@ int main(int argc, char *argv[]) {
             continue; // Skip to the next iteration of the loop
         }
 
-        // Duplicate the input to avoid modifying the original buffer during parsing
-        char *input2 = strdup(input);
-        args = parse_input(input2); // Parse the input into arguments
-
-        // Check for pipe commands
-        if (strstr(input, "|")) {
-            // Array to hold the commands to be piped
-            char *commands[MAX_ARGS];
-            int num_commands = 0;
-
-            // Tokenize the input by the pipe symbol to separate commands
-            char *command = strtok(input, "|");
-            while (command != NULL && num_commands < MAX_ARGS) {
-                commands[num_commands++] = command;
-                command = strtok(NULL, "|");
-            }
-
-            // Execute the commands with piping
-            execute_multiple_pipe_commands(commands, num_commands);
-        } else {
-            // If the command is not a built-in command, execute it as an external command
-            if (!execute_builtin(args)) {
-                execute_command(args);
-                add_to_history(input); // Add the command to the history
+        // Loops may span several lines; read the rest of the loop and run it
+        if (is_loop_start(input)) {
+            char *loop_text = collect_loop_text(input, stdin, 1);
+            if (loop_text != NULL) {
+                run_loop_text(loop_text);
+                free(loop_text);
             }
+            free(input);
+            continue;
         }
 
-        // Free the input buffers after processing
+        // Execute the line, recording external commands in the history
+        execute_line(input, 1);
+
+        // Free the input buffer after processing
         free(input);
-        free(input2);
     } while (status); // Continue looping until the status is set to 0 (exit)
 
     return 0; // Return success